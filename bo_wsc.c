@@ -1,9 +1,12 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <sys/lock.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "nvs_flash.h"
 #include "esp_attr.h"
 #include "esp_log.h"
@@ -47,12 +50,26 @@ static _lock_t s_lock;
 #define _bo_wsc_release() _lock_release(&s_lock);
 #endif
 
-typedef struct {
-    uint16_t valid : 1;
-    #ifndef CONFIG_BO_WSC_NVS_DISABLED
-    uint16_t dirty : 1;
-    #endif
-    uint16_t size : 10;
+#ifdef CONFIG_BO_WSC_RTC_DOUBLE_BUFFER
+#define BO_WSC_RTC_CACHE_SLOTS 2
+#else
+#define BO_WSC_RTC_CACHE_SLOTS 1
+#endif
+
+/*
+    Entry metadata fits in a single halfword so that it can be updated with one store. When double-buffered, new
+    contents are written to the inactive slot and then published by switching 'slot', so an interrupted update
+    leaves either the old or the new value. */
+typedef union {
+    struct {
+        uint16_t valid : 1;
+        #ifndef CONFIG_BO_WSC_NVS_DISABLED
+        uint16_t dirty : 1;
+        #endif
+        uint16_t slot : 1;
+        uint16_t size : 10;
+    };
+    uint16_t raw;
 } bo_wsc_nvs_metadata_t;
 _Static_assert(sizeof(bo_wsc_nvs_metadata_t) == sizeof(uint16_t), "");
 
@@ -184,11 +201,11 @@ BO_WSC_RTC_BSS_ATTR static union {
         BO_WSC_NVS_KEY_LIST
         #undef X
     ];
-} bo_ws_nvs_cache;
+} bo_ws_nvs_cache[BO_WSC_RTC_CACHE_SLOTS];
 
 #define X(_name, _key, _en, _size, _ns, _default) \
     + (_en ? _size : 0)
-_Static_assert(sizeof(bo_ws_nvs_cache) == 0 BO_WSC_NVS_KEY_LIST, "");
+_Static_assert(sizeof(bo_ws_nvs_cache[0]) == 0 BO_WSC_NVS_KEY_LIST, "");
 #undef X
 
 BO_WSC_RTC_BSS_ATTR static bo_wsc_nvs_metadata_t bo_ws_nvs_metadata[0
@@ -204,14 +221,14 @@ static const bo_wsc_nvs_desc_t bo_ws_nvs_desc[] = {
         { \
             .namespace_index = (offsetof(bo_wsc_nvs_namespaces_t, by_name._ns) / sizeof(((bo_wsc_nvs_namespaces_t*)0)->by_name._ns)), \
             .key = _key, \
-            .offset = offsetof(typeof(bo_ws_nvs_cache), _name), \
+            .offset = offsetof(typeof(bo_ws_nvs_cache[0]), _name), \
             .max_size = _size, \
         },
     #else
         #define X(_name, _key, _en, _size, _ns, _default) \
         { \
             .key = _key, \
-            .offset = offsetof(typeof(bo_ws_nvs_cache), _name), \
+            .offset = offsetof(typeof(bo_ws_nvs_cache[0]), _name), \
             .max_size = (_en ? _size : 0), \
         },
     #endif
@@ -230,6 +247,35 @@ static void __attribute__((constructor, section(("/DISCARD/")))) bo_wsc_check_me
     #undef X
 }
 
+static inline uint8_t *bo_wsc_cache_entry(size_t i, unsigned slot)
+{
+    return &bo_ws_nvs_cache[slot].bytes[bo_ws_nvs_desc[i].offset];
+}
+
+static inline uint8_t *bo_wsc_cache_active(size_t i)
+{
+    return bo_wsc_cache_entry(i, bo_ws_nvs_metadata[i].slot);
+}
+
+/*
+    Returns the slot that new contents for entry i should be written to, invalidating the entry first if that slot
+    is currently active (ie. not double-buffered). The fence keeps the caller's in-place write after the invalidation. */
+static unsigned bo_wsc_cache_prepare_update(size_t i)
+{
+    unsigned slot = (bo_ws_nvs_metadata[i].slot + 1) % BO_WSC_RTC_CACHE_SLOTS;
+    if(slot == bo_ws_nvs_metadata[i].slot)
+    {
+        __atomic_store_n(&bo_ws_nvs_metadata[i].raw, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return slot;
+}
+
+static inline void bo_wsc_metadata_publish(size_t i, bo_wsc_nvs_metadata_t metadata)
+{
+    __atomic_store_n(&bo_ws_nvs_metadata[i].raw, metadata.raw, __ATOMIC_RELEASE);
+}
+
 static ssize_t key_to_loc(const char *key)
 {
     for(ssize_t i = 0; i < ARRAY_SIZE(bo_ws_nvs_desc); ++i) {
@@ -245,6 +291,29 @@ static ssize_t key_to_loc(const char *key)
 #ifndef CONFIG_BO_WSC_NVS_DISABLED
 static bo_wsc_nvs_mode_t s_nvs_mode;
 
+typedef struct {
+    bo_wsc_nvs_metadata_t metadata[ARRAY_SIZE(bo_ws_nvs_metadata)];
+    uint8_t bytes[sizeof(bo_ws_nvs_cache[0])];
+} bo_wsc_txn_snapshot_t;
+
+static struct {
+    uint32_t depth;
+    bool rollback;
+    bo_wsc_txn_snapshot_t *snapshot;
+    TaskHandle_t owner;
+} s_txn;
+
+// A transaction may only be nested or ended by the task that opened it
+static bool bo_wsc_txn_foreign_task(void)
+{
+    if(s_txn.depth > 0 && s_txn.owner != xTaskGetCurrentTaskHandle())
+    {
+        ESP_LOGE(TAG, "transaction owned by another task");
+        return true;
+    }
+    return false;
+}
+
 static esp_err_t bo_wsc_nvs_ensure_namespace_open(size_t index)
 {
     if(!s_bo_wsc_nvs.by_index[index] != 0) {
@@ -292,7 +361,7 @@ static esp_err_t bo_wsc_do_save(void)
             }
 
             if(bo_ws_nvs_metadata[i].size > 0) {
-                err = nvs_set_blob(s_bo_wsc_nvs.by_index[bo_ws_nvs_desc[i].namespace_index], bo_ws_nvs_desc[i].key, &bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], bo_ws_nvs_metadata[i].size);
+                err = nvs_set_blob(s_bo_wsc_nvs.by_index[bo_ws_nvs_desc[i].namespace_index], bo_ws_nvs_desc[i].key, bo_wsc_cache_active(i), bo_ws_nvs_metadata[i].size);
                 if(err != ESP_OK) {
                     ESP_LOGE(TAG, "%s [%s] set_blob err 0x%x", __func__, bo_ws_nvs_desc[i].key, err);
                     return err;
@@ -315,7 +384,9 @@ static esp_err_t bo_wsc_do_save(void)
             if(ns_altered) {
                 ns_dirty[bo_ws_nvs_desc[i].namespace_index] = true;
             }
-            bo_ws_nvs_metadata[i].dirty = 0;
+            bo_wsc_nvs_metadata_t metadata = bo_ws_nvs_metadata[i];
+            metadata.dirty = 0;
+            bo_wsc_metadata_publish(i, metadata);
         }
     }
 
@@ -333,12 +404,22 @@ static esp_err_t bo_wsc_do_save(void)
     return ret;
 }
 
+// Saves are deferred to bo_wsc_end while a transaction is open
+static esp_err_t bo_wsc_save_unless_txn(void)
+{
+    if(s_txn.depth > 0) {
+        ESP_LOGD(TAG, "%s deferred (depth:%" PRIu32 ")", __func__, s_txn.depth);
+        return ESP_OK;
+    }
+    return bo_wsc_do_save();
+}
+
 esp_err_t bo_wsc_nvs_save(void)
 {
     esp_err_t ret = ESP_ERR_INVALID_STATE;
     _bo_wsc_lock();
     if(s_nvs_mode == BO_WSC_NVS_MODE_MANUAL) {
-        ret = bo_wsc_do_save();
+        ret = bo_wsc_save_unless_txn();
     }
     _bo_wsc_release();
     return ret;
@@ -354,7 +435,99 @@ esp_err_t bo_wsc_nvs_mode(bo_wsc_nvs_mode_t mode)
         s_nvs_mode = mode;
         if(mode == BO_WSC_NVS_MODE_AUTO)
         {
-            err = bo_wsc_do_save();
+            err = bo_wsc_save_unless_txn();
+        }
+    }
+    _bo_wsc_release();
+    return err;
+}
+
+static void bo_wsc_txn_take_snapshot(bo_wsc_txn_snapshot_t *snapshot)
+{
+    for(int i = 0; i < ARRAY_SIZE(bo_ws_nvs_metadata); ++i) {
+        snapshot->metadata[i] = bo_ws_nvs_metadata[i];
+        if(snapshot->metadata[i].valid) {
+            memcpy(&snapshot->bytes[bo_ws_nvs_desc[i].offset], bo_wsc_cache_active(i), snapshot->metadata[i].size);
+        }
+    }
+}
+
+static void bo_wsc_txn_restore_snapshot(const bo_wsc_txn_snapshot_t *snapshot)
+{
+    for(int i = 0; i < ARRAY_SIZE(bo_ws_nvs_metadata); ++i) {
+        bo_wsc_nvs_metadata_t metadata = snapshot->metadata[i];
+        size_t size = metadata.valid ? metadata.size : 0;
+        if(
+            metadata.valid == bo_ws_nvs_metadata[i].valid &&
+            metadata.dirty == bo_ws_nvs_metadata[i].dirty &&
+            metadata.size == bo_ws_nvs_metadata[i].size &&
+            memcmp(bo_wsc_cache_active(i), &snapshot->bytes[bo_ws_nvs_desc[i].offset], size) == 0
+        )
+        {
+            continue;
+        }
+        ESP_LOGD(TAG, "%s [%s] restoring", __func__, bo_ws_nvs_desc[i].key);
+        unsigned slot = bo_wsc_cache_prepare_update(i);
+        memcpy(bo_wsc_cache_entry(i, slot), &snapshot->bytes[bo_ws_nvs_desc[i].offset], size);
+        metadata.slot = slot;
+        bo_wsc_metadata_publish(i, metadata);
+    }
+}
+
+esp_err_t bo_wsc_begin(void)
+{
+    esp_err_t err = ESP_OK;
+    _bo_wsc_lock();
+    if(bo_wsc_txn_foreign_task()) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else if(s_txn.depth == 0) {
+        s_txn.snapshot = malloc(sizeof(*s_txn.snapshot));
+        if(s_txn.snapshot == NULL) {
+            ESP_LOGE(TAG, "%s snapshot alloc failed (%u bytes)", __func__, sizeof(*s_txn.snapshot));
+            err = ESP_ERR_NO_MEM;
+        }
+        else {
+            bo_wsc_txn_take_snapshot(s_txn.snapshot);
+            s_txn.rollback = false;
+            s_txn.owner = xTaskGetCurrentTaskHandle();
+        }
+    }
+    if(err == ESP_OK) {
+        ++s_txn.depth;
+        ESP_LOGD(TAG, "%s (depth:%" PRIu32 ")", __func__, s_txn.depth);
+    }
+    _bo_wsc_release();
+    return err;
+}
+
+esp_err_t bo_wsc_end(bool rollback)
+{
+    esp_err_t err = ESP_OK;
+    _bo_wsc_lock();
+    if(s_txn.depth == 0) {
+        ESP_LOGE(TAG, "%s no transaction", __func__);
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else if(bo_wsc_txn_foreign_task()) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else {
+        ESP_LOGD(TAG, "%s (depth:%" PRIu32 ", rollback:%d)", __func__, s_txn.depth, rollback);
+        s_txn.rollback |= rollback;
+        if(--s_txn.depth == 0) {
+            if(s_txn.rollback) {
+                bo_wsc_txn_restore_snapshot(s_txn.snapshot);
+                if(!rollback) {
+                    ESP_LOGE(TAG, "%s changes discarded by nested rollback", __func__);
+                    err = ESP_ERR_INVALID_STATE;
+                }
+            }
+            else {
+                err = bo_wsc_do_save();
+            }
+            free(s_txn.snapshot);
+            s_txn.snapshot = NULL;
         }
     }
     _bo_wsc_release();
@@ -384,7 +557,7 @@ static esp_err_t bo_wsc_nvs_do_set(nvs_handle_t handle, const char* key, const v
     ESP_LOGD(TAG, "Setting %s (%u)", key, size);
     if(bo_ws_nvs_metadata[i].valid && bo_ws_nvs_metadata[i].size > 0)
     {
-        ESP_LOG_BUFFER_HEX_LEVEL("old", &bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], bo_ws_nvs_metadata[i].size, ESP_LOG_DEBUG);
+        ESP_LOG_BUFFER_HEX_LEVEL("old", bo_wsc_cache_active(i), bo_ws_nvs_metadata[i].size, ESP_LOG_DEBUG);
     }
     ESP_LOG_BUFFER_HEX_LEVEL("new", data, size, ESP_LOG_DEBUG);
 
@@ -392,17 +565,21 @@ static esp_err_t bo_wsc_nvs_do_set(nvs_handle_t handle, const char* key, const v
     if(
         !bo_ws_nvs_metadata[i].valid ||
         bo_ws_nvs_metadata[i].size != size ||
-        memcmp(&bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], data, size) != 0
+        memcmp(bo_wsc_cache_active(i), data, size) != 0
     )
     {
         ESP_LOGD(TAG, "%s [%s] updating", __func__, key);
-        memset(&bo_ws_nvs_metadata[i], 0, sizeof(bo_ws_nvs_metadata[i]));
-        memcpy(&bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], data, size);
+        unsigned slot = bo_wsc_cache_prepare_update(i);
+        memcpy(bo_wsc_cache_entry(i, slot), data, size);
+        bo_wsc_nvs_metadata_t metadata = {
+            .valid = 1,
+            .slot = slot,
+            .size = size,
+        };
         #ifndef CONFIG_BO_WSC_NVS_DISABLED
-            bo_ws_nvs_metadata[i].dirty = 1;
+            metadata.dirty = 1;
         #endif
-        bo_ws_nvs_metadata[i].size = size;
-        bo_ws_nvs_metadata[i].valid = 1;
+        bo_wsc_metadata_publish(i, metadata);
     }
     _bo_wsc_release();
     return ESP_OK;
@@ -424,23 +601,19 @@ static esp_err_t bo_wsc_nvs_do_get(nvs_handle_t handle, const char* key, void *d
         ret = bo_wsc_nvs_ensure_namespace_open(bo_ws_nvs_desc[i].namespace_index);
         if(ret == ESP_OK)
         {
-            memset(&bo_ws_nvs_metadata[i], 0, sizeof(bo_ws_nvs_metadata[i]));
+            unsigned slot = bo_wsc_cache_prepare_update(i);
             size_t len = bo_ws_nvs_desc[i].max_size;
-            ret = nvs_get_blob(s_bo_wsc_nvs.by_index[bo_ws_nvs_desc[i].namespace_index], bo_ws_nvs_desc[i].key, &bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], &len);
+            ret = nvs_get_blob(s_bo_wsc_nvs.by_index[bo_ws_nvs_desc[i].namespace_index], bo_ws_nvs_desc[i].key, bo_wsc_cache_entry(i, slot), &len);
             if(ret == ESP_OK) {
                 if(len != bo_ws_nvs_desc[i].max_size) {
                     ESP_LOGW(TAG, "[%s] \"%s\" size: %u != %u", __func__, bo_ws_nvs_desc[i].key, len, bo_ws_nvs_desc[i].max_size);
                 }
-                memcpy(data, &bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], len);
-                bo_ws_nvs_metadata[i].dirty = 0;
-                bo_ws_nvs_metadata[i].size = len;
-                bo_ws_nvs_metadata[i].valid = 1;
+                memcpy(data, bo_wsc_cache_entry(i, slot), len);
+                bo_wsc_metadata_publish(i, (bo_wsc_nvs_metadata_t){ .valid = 1, .dirty = 0, .slot = slot, .size = len });
             }
             else if(ret == ESP_ERR_NVS_NOT_FOUND)
             {
-                bo_ws_nvs_metadata[i].dirty = 0;
-                bo_ws_nvs_metadata[i].size = 0;
-                bo_ws_nvs_metadata[i].valid = 1;
+                bo_wsc_metadata_publish(i, (bo_wsc_nvs_metadata_t){ .valid = 1, .dirty = 0, .slot = slot, .size = 0 });
                 ret = ESP_OK;
             }
             else
@@ -473,7 +646,7 @@ static esp_err_t bo_wsc_nvs_do_get(nvs_handle_t handle, const char* key, void *d
                 }
                 else
                 {
-                    memcpy(data, &bo_ws_nvs_cache.bytes[bo_ws_nvs_desc[i].offset], bo_ws_nvs_metadata[i].size);
+                    memcpy(data, bo_wsc_cache_active(i), bo_ws_nvs_metadata[i].size);
                     *size = bo_ws_nvs_metadata[i].size;
                 }
             }
@@ -498,14 +671,16 @@ static esp_err_t bo_wsc_nvs_do_erase(nvs_handle_t handle, const char* key)
     }
 
     _bo_wsc_lock();
+    bo_wsc_nvs_metadata_t metadata = bo_ws_nvs_metadata[i];
 #ifndef CONFIG_BO_WSC_NVS_DISABLED
-    if(bo_ws_nvs_metadata[i].valid && bo_ws_nvs_metadata[i].size > 0)
+    if(metadata.valid && metadata.size > 0)
     {
-        bo_ws_nvs_metadata[i].dirty = 1;
+        metadata.dirty = 1;
     }
 #endif
-    bo_ws_nvs_metadata[i].size = 0;
-    bo_ws_nvs_metadata[i].valid = 1;
+    metadata.size = 0;
+    metadata.valid = 1;
+    bo_wsc_metadata_publish(i, metadata);
     _bo_wsc_release();
     return ESP_OK;
 }
@@ -517,7 +692,7 @@ static esp_err_t bo_wsc_nvs_do_commit(nvs_handle_t handle)
     esp_err_t ret = ESP_OK;
     _bo_wsc_lock();
     if(s_nvs_mode == BO_WSC_NVS_MODE_AUTO) {
-        ret = bo_wsc_do_save();
+        ret = bo_wsc_save_unless_txn();
     }
     _bo_wsc_release();
     return ret;
@@ -2,6 +2,7 @@
 #define BO_WSC_H
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "esp_wifi.h"
@@ -19,12 +20,16 @@ typedef enum {
 /**
  * Set NVS write mode.
  * 
- * Manual (default): Changes will only be saved to NVS flash by bo_wsc_nvs_save.
+ * Manual (default): Changes will only be saved to NVS flash by bo_wsc_nvs_save, or on ending the outermost
+ * transaction (see bo_wsc_end).
  * Auto: Save any pending changes and, thereafter, automatically save as requested by the WiFi driver.
  * 
  * In a low-latency application with persistence, this should be left in Manual mode until WiFi
  * completes initialisation and/or connection for efficiency, then changed to Auto mode to keep NVS
  * up-to-date.
+ * 
+ * Within a transaction (see bo_wsc_begin), switching to Auto mode does not save; pending changes, and any saves
+ * requested by the WiFi driver, are deferred to the outermost bo_wsc_end.
  */
 #ifdef CONFIG_BO_WSC_NVS_DISABLED
 __attribute__((error ("NVS support disabled")))
@@ -33,12 +38,47 @@ esp_err_t bo_wsc_nvs_mode(bo_wsc_nvs_mode_t mode);
 
 /**
  * Write changes to flash when NVS mode is BO_WSC_NVS_MODE_MANUAL (default)
+ * 
+ * Within a transaction (see bo_wsc_begin), this returns ESP_OK without writing to flash; the save is deferred to
+ * the outermost bo_wsc_end.
  */
 #ifdef CONFIG_BO_WSC_NVS_DISABLED
 __attribute__((error ("NVS support disabled")))
 #endif
 esp_err_t bo_wsc_nvs_save(void);
 
+/**
+ * Begin a transaction.
+ * 
+ * Until the matching bo_wsc_end, commits requested by the WiFi driver (and bo_wsc_nvs_save) are deferred so that
+ * a sequence of configuration changes is written to flash once. Transactions may be nested; only the outermost
+ * bo_wsc_end takes effect.
+ * 
+ * A transaction belongs to the task that opened it: while it is open, bo_wsc_begin and bo_wsc_end from any other
+ * task fail with ESP_ERR_INVALID_STATE. Deferral of driver-requested saves applies to all tasks.
+ * 
+ * The outermost bo_wsc_begin takes a snapshot of the RTC cache in heap memory for rollback.
+ */
+#ifdef CONFIG_BO_WSC_NVS_DISABLED
+__attribute__((error ("NVS support disabled")))
+#endif
+esp_err_t bo_wsc_begin(void);
+
+/**
+ * End a transaction started by bo_wsc_begin.
+ * 
+ * When the outermost transaction ends, all pending changes are saved to NVS (regardless of NVS mode), or, if
+ * rollback was requested by this or any nested bo_wsc_end, the RTC cache is restored to its state at the
+ * outermost bo_wsc_begin and nothing is saved.
+ * 
+ * Returns ESP_ERR_INVALID_STATE if there is no open transaction, if it was opened by another task, or if this
+ * outermost bo_wsc_end requested a commit but the changes were discarded by a nested rollback.
+ */
+#ifdef CONFIG_BO_WSC_NVS_DISABLED
+__attribute__((error ("NVS support disabled")))
+#endif
+esp_err_t bo_wsc_end(bool rollback);
+
 /**
  * Enable WiFi Storage Cache by setting functions in OSI struct (typically &g_wifi_osi_funcs).
  */